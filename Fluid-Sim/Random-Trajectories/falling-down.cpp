@@ -1,7 +1,16 @@
 #include <GLFW/glfw3.h>
 #include <vector>
 #include <cmath>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
 #include <cstdlib>
+#include <algorithm>
+#include <thread>
+#include <cstdint>
 
 const int NUM_PARTICLES = 1000;
 const float DT = 0.005f;
@@ -9,6 +18,19 @@ const float MAX_VELOCITY = 1.0f;
 const float PIPE_LENGTH = 1.0f;
 const float GRAVITY = -0.1f;
 
+// Time stepping. DT is the fixed baseline; adaptive steps follow the CFL limit
+// of the fastest particle against the local pipe width, and substeps let the
+// few fast particles split their own move instead
+const float CFL_NUMBER = 0.25f;
+const float MIN_STEP = DT / 64.0f;
+const float MAX_STEP = 8.0f * DT;
+const int MAX_SUBSTEPS = 8;
+const float FRAME_TIME = DT;  // Simulated time between two rendered frames
+bool adaptiveStepping = false;
+bool particleSubsteps = false;
+float timeStep = DT;
+double simulationTime = 0.0;
+
 struct Particle {
 	float x, y, vx, vy;
 };
@@ -24,6 +46,7 @@ float pipeWidth(float x) {
 // Initialize particles
 void initParticles() {
 	particles.clear();
+	simulationTime = 0.0;
 	for (int i = 0; i < NUM_PARTICLES; i++) {
 		float x = static_cast<float>(rand()) / RAND_MAX * PIPE_LENGTH;
 		float y = (static_cast<float>(rand()) / RAND_MAX - 0.5f) * pipeWidth(x);
@@ -31,26 +54,132 @@ void initParticles() {
 	}
 }
 
+// Pick the step from the CFL limit, never stepping over until
+void chooseTimeStep(double until) {
+	if (!adaptiveStepping) {
+		timeStep = DT;
+		return;
+	}
+	float limit = HUGE_VALF;
+	for (const auto &p : particles) {
+		float speed = std::sqrt(p.vx * p.vx + p.vy * p.vy);
+		limit = std::min(limit, pipeWidth(p.x) / std::max(speed, 1e-6f));
+	}
+	limit *= CFL_NUMBER;
+	if (particleSubsteps) limit *= MAX_SUBSTEPS;
+	timeStep = std::min(std::max(limit, MIN_STEP), MAX_STEP);
+
+	double remaining = until - simulationTime;
+	if (remaining < double(timeStep) + MIN_STEP) timeStep = float(std::max(remaining, double(MIN_STEP)));
+}
+
+// Substeps a particle needs to cross at most CFL_NUMBER local widths per substep
+int substepCount(const Particle &p) {
+	if (!particleSubsteps) return 1;
+	float travel = timeStep * std::sqrt(p.vx * p.vx + p.vy * p.vy);
+	float allowed = CFL_NUMBER * pipeWidth(p.x);
+	if (travel <= allowed) return 1;
+	return std::min(MAX_SUBSTEPS, int(std::ceil(travel / allowed)));
+}
+
 // Monte Carlo simulation step
-void updateParticles() {
+void updateParticles(double until = HUGE_VAL) {
+	chooseTimeStep(until);
+	simulationTime += timeStep;
+	float kickScale = std::sqrt(timeStep / DT);  // Random walk: kick variance grows linearly with the step
+
 	for (auto &p : particles) {
-		p.vx += ((rand() % 200 - 100) / 5000.0f);
-		p.vy += GRAVITY * DT;
+		p.vx += ((rand() % 200 - 100) / 5000.0f) * kickScale;
+		p.vy += GRAVITY * timeStep;
 
-		p.x += p.vx * DT;
-		p.y += p.vy * DT;
+		int substeps = substepCount(p);
+		float h = timeStep / substeps;
+		for (int k = 0; k < substeps; ++k) {
+			p.x += p.vx * h;
+			p.y += p.vy * h;
 
-		if (p.x > PIPE_LENGTH) p.x -= PIPE_LENGTH;
-		if (p.x < 0) p.x += PIPE_LENGTH;
+			if (p.x > PIPE_LENGTH) p.x -= PIPE_LENGTH;
+			if (p.x < 0) p.x += PIPE_LENGTH;
 
-		float halfWidth = pipeWidth(p.x) / 2.0f;
-		if (fabs(p.y) > halfWidth) {
-			p.y = copysign(halfWidth, p.y);
-			p.vy *= -0.5f;
+			float halfWidth = pipeWidth(p.x) / 2.0f;
+			if (fabs(p.y) > halfWidth) {
+				p.y = copysign(halfWidth, p.y);
+				p.vy *= -0.5f;
+			}
 		}
 	}
 }
 
+// Fixed-timestep accumulator for rendering: take steps of whatever size until
+// the next frame boundary FRAME_TIME of simulated time later
+void advanceFrame() {
+	double frameEnd = simulationTime + FRAME_TIME;
+	do {
+		updateParticles(frameEnd);
+	} while (simulationTime < frameEnd - 1e-3 * MIN_STEP);
+}
+
+// Particle statistics for headless runs, one TSV row per call
+void printStats(long step) {
+	double sumVx = 0.0, sumVy = 0.0, maxSpeed = 0.0;
+	for (const auto &p : particles) {
+		sumVx += p.vx;
+		sumVy += p.vy;
+		maxSpeed = std::max(maxSpeed, double(std::hypot(p.vx, p.vy)));
+	}
+	double n = std::max<double>(particles.size(), 1.0);
+	std::cout << step << "\t" << simulationTime << "\t" << particles.size() << "\t" << sumVx / n << "\t" << sumVy / n
+		<< "\t" << maxSpeed << "\n";
+}
+
+// Advance the simulation without any GL context, as fast as it will go
+void runHeadless(long steps, long statsEvery) {
+	initParticles();
+	std::cout << "step\ttime\tparticles\tmean_vx\tmean_vy\tmax_speed\n";
+	printStats(0);
+
+	double updates = 0.0;
+	auto t0 = std::chrono::steady_clock::now();
+	for (long step = 1; step <= steps; ++step) {
+		updates += particles.size();
+		updateParticles();
+		if (statsEvery > 0 && step % statsEvery == 0) printStats(step);
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+	std::cerr << steps << " steps in " << seconds << " s: " << steps / seconds << " steps/s, "
+		<< updates / seconds << " particle-updates/s\n";
+}
+
+// Wall-clock time to reach simulated time T with the fixed DT, the CFL stepper
+// and the CFL stepper with per-particle substeps, from the same seed
+void compareStepping(double T) {
+	struct Stepping {
+		const char *name;
+		bool adaptive, substeps;
+	} configs[3] = {{"fixed", false, false}, {"adaptive", true, false}, {"substeps", true, true}};
+
+	std::cout << "stepping\tsteps\tseconds\tparticles\tmean_vx\tspeedup\n";
+	double baseline = 0.0;
+	for (const Stepping &config : configs) {
+		adaptiveStepping = config.adaptive;
+		particleSubsteps = config.substeps;
+		srand(12345);
+		initParticles();
+
+		long steps = 0;
+		auto t0 = std::chrono::steady_clock::now();
+		for (; simulationTime < T - 1e-3 * MIN_STEP; ++steps) updateParticles(T);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		if (!config.adaptive) baseline = seconds;
+
+		double sumVx = 0.0;
+		for (const auto &p : particles) sumVx += p.vx;
+		std::cout << config.name << "\t" << steps << "\t" << seconds << "\t" << particles.size() << "\t"
+			<< sumVx / std::max<double>(particles.size(), 1.0) << "\t" << baseline / seconds << "\n";
+	}
+}
+
 // Render pipe walls
 void renderPipe() {
 	glColor3f(1.0f, 1.0f, 1.0f);
@@ -81,33 +210,369 @@ void renderParticles() {
 	glEnd();
 }
 
+// Points draws every particle; Density bins them into a screen-sized
+// histogram and draws a single texture, so the render cost
+// follows the resolution rather than the particle count
+enum class RenderMode { Points, Density };
+RenderMode renderMode = RenderMode::Points;
+
+const float VIEW_X0 = 0.0f, VIEW_X1 = PIPE_LENGTH;  // Visible part of the pipe
+const float VIEW_Y0 = -0.3f, VIEW_Y1 = 0.3f;
+
+struct DensityMap {
+	int width = 0, height = 0;
+	std::vector<float> bins;      // width * height (count, summed |vx|) pairs
+	std::vector<uint32_t> image;  // Colormapped RGBA8, bottom row first
+	GLuint texture = 0;
+} density;
+
+// Histogram the particles and colormap the bins: brightness is log density,
+// hue the mean |vx| like the points
+void binDensity(int width, int height) {
+	size_t pixels = size_t(width) * height;
+	std::vector<float> &total = density.bins;
+	total.assign(pixels * 2, 0.0f);
+	density.image.resize(pixels);
+
+	float sx = width / (VIEW_X1 - VIEW_X0), sy = height / (VIEW_Y1 - VIEW_Y0);
+	for (const Particle &p : particles) {
+		float u = (p.x - VIEW_X0) * sx, v = (p.y - VIEW_Y0) * sy;
+		if (!(u >= 0.0f && u < width && v >= 0.0f && v < height)) continue;
+		size_t pixel = size_t(v) * width + size_t(u);
+		total[2 * pixel] += 1.0f;
+		total[2 * pixel + 1] += std::abs(p.vx);
+	}
+
+	float peak = 1.0f;
+	for (size_t k = 0; k < pixels * 2; k += 2) peak = std::max(peak, total[k]);
+
+	float scale = 255.0f / std::log1p(peak);
+	for (size_t pixel = 0; pixel < pixels; ++pixel) {
+		float count = total[2 * pixel];
+		if (count == 0.0f) {
+			density.image[pixel] = 0xff000000u;
+			continue;
+		}
+		float intensity = std::log1p(count) * scale;
+		float speedFactor = std::min(1.0f, total[2 * pixel + 1] / count / MAX_VELOCITY);
+		uint32_t r = uint32_t(intensity * (1.0f - speedFactor)), g = uint32_t(intensity), b = uint32_t(intensity * speedFactor);
+		density.image[pixel] = r | g << 8 | b << 16 | 0xff000000u;  // RGBA bytes in memory order
+	}
+}
+
+// Bin at framebuffer resolution, upload and stretch the texture over the view
+void renderDensity(int width, int height) {
+	binDensity(width, height);
+	if (!density.texture) glGenTextures(1, &density.texture);
+	glBindTexture(GL_TEXTURE_2D, density.texture);
+	if (width != density.width || height != density.height) {
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, density.image.data());
+		density.width = width;
+		density.height = height;
+	} else {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, density.image.data());
+	}
+
+	glEnable(GL_TEXTURE_2D);
+	glColor3f(1.0f, 1.0f, 1.0f);
+	glBegin(GL_QUADS);
+	glTexCoord2f(0.0f, 0.0f); glVertex2f(VIEW_X0, VIEW_Y0);
+	glTexCoord2f(1.0f, 0.0f); glVertex2f(VIEW_X1, VIEW_Y0);
+	glTexCoord2f(1.0f, 1.0f); glVertex2f(VIEW_X1, VIEW_Y1);
+	glTexCoord2f(0.0f, 1.0f); glVertex2f(VIEW_X0, VIEW_Y1);
+	glEnd();
+	glDisable(GL_TEXTURE_2D);
+}
+
 // OpenGL display function
-void display() {
+void display(GLFWwindow *window) {
 	glClear(GL_COLOR_BUFFER_BIT);
+	if (renderMode == RenderMode::Density) {
+		int width, height;
+		glfwGetFramebufferSize(window, &width, &height);
+		if (width > 0 && height > 0) renderDensity(width, height);
+		renderPipe();
+		return;
+	}
 	renderPipe();
 	renderParticles();
 }
 
-// Main function
-int main() {
+const int EXPORT_QUEUE_DEPTH = 8;  // Frames in flight between the readback and the encoder
+
+enum class ExportFormat { Ppm, Y4m };
+
+// Encodes exported frames on its own thread. The producer copies raw RGB
+// rows (bottom row first, as glReadPixels returns them) into a free slot and
+// queues it; the encoder flips and writes them in order, one PPM per frame
+// or a single 4:4:4 Y4M stream. A full queue makes the producer wait rather
+// than drop frames, and the wait is reported
+class FrameExporter {
+public:
+	~FrameExporter() { finish(); }
+
+	bool start(const std::string &pathPrefix, ExportFormat exportFormat, int frameWidth, int frameHeight, int fps) {
+		prefix = pathPrefix;
+		format = exportFormat;
+		width = frameWidth;
+		height = frameHeight;
+		for (Slot &slot : slots) slot.rgb.resize(size_t(width) * height * 3);
+		if (format == ExportFormat::Y4m) {
+			stream.open(prefix + ".y4m", std::ios::binary);
+			if (!stream) {
+				std::cerr << "Cannot open " << prefix << ".y4m\n";
+				return false;
+			}
+			stream << "YUV4MPEG2 W" << width << " H" << height << " F" << fps << ":1 Ip A1:1 C444\n";
+			planes.resize(size_t(width) * height * 3);
+		}
+		stopping = false;
+		started = std::chrono::steady_clock::now();
+		encoder = std::thread([this] { loop(); });
+		return true;
+	}
+
+	// Free slot for the next frame, waiting for the encoder if all are queued
+	uint8_t *claim() {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			for (int k = 0; k < EXPORT_QUEUE_DEPTH; ++k) {
+				if (slots[k].state == Free) {
+					slots[k].state = Filling;
+					filling = k;
+					return slots[k].rgb.data();
+				}
+			}
+			auto t0 = std::chrono::steady_clock::now();
+			wake.wait(lock);
+			waited += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		}
+	}
+
+	void submit() {
+		std::lock_guard<std::mutex> lock(mutex);
+		slots[filling].sequence = submitted++;
+		slots[filling].state = Queued;
+		wake.notify_all();
+	}
+
+	// Drain the queue, stop the encoder and report the achieved export rate
+	void finish() {
+		if (!encoder.joinable()) return;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		encoder.join();
+		stream.close();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+		std::cerr << written << " frames exported in " << seconds << " s: " << written / seconds << " fps (encoder busy "
+			<< encoding << " s, producer waited " << waited << " s on a full queue)\n";
+	}
+
+private:
+	enum SlotState { Free, Filling, Queued };
+
+	struct Slot {
+		std::vector<uint8_t> rgb;
+		long sequence = 0;
+		SlotState state = Free;
+	};
+
+	void loop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			int slot = -1;
+			for (int k = 0; k < EXPORT_QUEUE_DEPTH; ++k) {
+				if (slots[k].state == Queued && (slot < 0 || slots[k].sequence < slots[slot].sequence)) slot = k;
+			}
+			if (slot < 0) {
+				if (stopping) return;
+				wake.wait(lock);
+				continue;
+			}
+			lock.unlock();
+
+			auto t0 = std::chrono::steady_clock::now();
+			write(slots[slot]);
+			double busy = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+			lock.lock();
+			encoding += busy;
+			++written;
+			slots[slot].state = Free;
+			wake.notify_all();
+		}
+	}
+
+	void write(const Slot &slot) {
+		size_t rowBytes = size_t(width) * 3;
+		if (format == ExportFormat::Ppm) {
+			std::string digits = std::to_string(slot.sequence);
+			std::string path = prefix + "-" + std::string(digits.size() < 8 ? 8 - digits.size() : 0, '0') + digits + ".ppm";
+			std::ofstream out(path, std::ios::binary);
+			out << "P6\n" << width << " " << height << "\n255\n";
+			for (int y = height - 1; y >= 0; --y) {
+				out.write(reinterpret_cast<const char *>(&slot.rgb[y * rowBytes]), rowBytes);
+			}
+			if (!out) std::cerr << "Failed to write frame " << path << "\n";
+			return;
+		}
+
+		// BT.601 studio range, full resolution chroma planes
+		size_t plane = size_t(width) * height;
+		for (int y = 0; y < height; ++y) {
+			const uint8_t *rgb = &slot.rgb[(height - 1 - y) * rowBytes];
+			for (int x = 0; x < width; ++x) {
+				int r = rgb[3 * x], g = rgb[3 * x + 1], b = rgb[3 * x + 2];
+				size_t pixel = size_t(y) * width + x;
+				planes[pixel] = uint8_t(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+				planes[plane + pixel] = uint8_t(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+				planes[2 * plane + pixel] = uint8_t(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+			}
+		}
+		stream << "FRAME\n";
+		stream.write(reinterpret_cast<const char *>(planes.data()), planes.size());
+		if (!stream) std::cerr << "Failed to write frame " << slot.sequence << " to " << prefix << ".y4m\n";
+	}
+
+	std::string prefix;
+	ExportFormat format = ExportFormat::Ppm;
+	int width = 0, height = 0;
+	std::ofstream stream;
+	std::vector<uint8_t> planes;
+	std::thread encoder;
+	std::mutex mutex;
+	std::condition_variable wake;
+	Slot slots[EXPORT_QUEUE_DEPTH];
+	int filling = -1;
+	long submitted = 0;
+	size_t written = 0;
+	double encoding = 0.0, waited = 0.0;
+	bool stopping = false;
+	std::chrono::steady_clock::time_point started;
+};
+
+// Offline movie: render frames into a hidden window in lockstep with the
+// simulation, FRAME_TIME of simulated time apart, and hand every one to the
+// encoder thread. Only the glReadPixels copy stays on this thread
+int runExport(const std::string &prefix, ExportFormat format, long frames, int fps) {
+	if (!glfwInit()) return -1;
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	GLFWwindow *window = glfwCreateWindow(800, 400, "2D Fluid Simulation export", NULL, NULL);
+	if (!window) { glfwTerminate(); return -1; }
+
+	glfwMakeContextCurrent(window);
+	glOrtho(VIEW_X0, VIEW_X1, VIEW_Y0, VIEW_Y1, -1, 1);
+	int width, height;
+	glfwGetFramebufferSize(window, &width, &height);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadBuffer(GL_BACK);
+
+	initParticles();
+	FrameExporter exporter;
+	if (!exporter.start(prefix, format, width, height, fps)) {
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		return -1;
+	}
+	for (long frame = 0; frame < frames; ++frame) {
+		if (frame > 0) advanceFrame();
+		display(window);
+		glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, exporter.claim());
+		exporter.submit();
+		glfwSwapBuffers(window);
+		glfwPollEvents();
+	}
+	exporter.finish();
+
+	if (density.texture) glDeleteTextures(1, &density.texture);
+	glfwDestroyWindow(window);
+	glfwTerminate();
+	return 0;
+}
+
+// Interactive front end: FRAME_TIME of simulated time per displayed frame
+int runWindowed() {
 	if (!glfwInit()) return -1;
 	GLFWwindow *window = glfwCreateWindow(800, 400, "2D Fluid Simulation", NULL, NULL);
 	if (!window) { glfwTerminate(); return -1; }
 
 	glfwMakeContextCurrent(window);
-	glOrtho(0, PIPE_LENGTH, -0.3, 0.3, -1, 1);
+	glOrtho(VIEW_X0, VIEW_X1, VIEW_Y0, VIEW_Y1, -1, 1);
 
 	initParticles();
 
 	while (!glfwWindowShouldClose(window)) {
-		updateParticles();
-		display();
+		advanceFrame();
+		display(window);
 		glfwSwapBuffers(window);
 		glfwPollEvents();
 	}
 
+	if (density.texture) glDeleteTextures(1, &density.texture);
 	glfwDestroyWindow(window);
 	glfwTerminate();
 	return 0;
 }
 
+const char USAGE[] =
+	" [--headless --steps N --stats-every N] [--adaptive --substeps --compare-stepping --sim-time T]\n"
+	"       [--render points|density] [--export PREFIX --export-format ppm|y4m --frames N --export-fps N]\n";
+
+// Main function
+int main(int argc, char **argv) {
+	bool headless = false;
+	bool compare = false;
+	long steps = 1000;
+	long statsEvery = 100;
+	double simTime = 1.0;
+	std::string exportPrefix;
+	ExportFormat exportFormat = ExportFormat::Ppm;
+	long exportFrames = 300;
+	int exportFps = 30;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--headless") headless = true;
+		else if (arg == "--adaptive") adaptiveStepping = true;
+		else if (arg == "--substeps") adaptiveStepping = particleSubsteps = true;
+		else if (arg == "--compare-stepping") compare = true;
+		else if (arg == "--sim-time" && i + 1 < argc) simTime = std::stod(argv[++i]);
+		else if (arg == "--steps" && i + 1 < argc) steps = std::stol(argv[++i]);
+		else if (arg == "--stats-every" && i + 1 < argc) statsEvery = std::stol(argv[++i]);
+		else if (arg == "--export" && i + 1 < argc) exportPrefix = argv[++i];
+		else if (arg == "--frames" && i + 1 < argc) exportFrames = std::stol(argv[++i]);
+		else if (arg == "--export-fps" && i + 1 < argc) exportFps = std::max(1, std::stoi(argv[++i]));
+		else if (arg == "--export-format" && i + 1 < argc) {
+			std::string format = argv[++i];
+			if (format == "ppm") exportFormat = ExportFormat::Ppm;
+			else if (format == "y4m") exportFormat = ExportFormat::Y4m;
+			else { std::cerr << "Unknown export format: " << format << " (ppm, y4m)\n"; return -1; }
+		}
+		else if (arg == "--render" && i + 1 < argc) {
+			std::string mode = argv[++i];
+			if (mode == "points") renderMode = RenderMode::Points;
+			else if (mode == "density") renderMode = RenderMode::Density;
+			else { std::cerr << "Unknown render mode: " << mode << " (points, density)\n"; return -1; }
+		}
+		else {
+			std::cerr << (i + 1 == argc ? "Unknown argument or missing value: " : "Unknown argument: ") << arg << "\n"
+			          << "usage: " << argv[0] << USAGE;
+			return -1;
+		}
+	}
+
+	if (compare) {
+		compareStepping(simTime);
+		return 0;
+	}
+	if (headless) {
+		runHeadless(steps, statsEvery);
+		return 0;
+	}
+	if (!exportPrefix.empty()) return runExport(exportPrefix, exportFormat, exportFrames, exportFps);
+	return runWindowed();
+}
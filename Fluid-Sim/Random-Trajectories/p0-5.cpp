@@ -1,8 +1,19 @@
 #include <GLFW/glfw3.h>
 #include <vector>
 #include <cmath>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
 #include <random>
 #include <algorithm>
+#include <thread>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
 
 const int NUM_PARTICLES = 3000;
 const float DT = 0.005f;
@@ -11,6 +22,20 @@ const float PRESSURE_FORCE = 0.5f;
 const float MAX_VELOCITY = 1.0f;
 const float INJECTION_RATE = 5;
 
+// Time stepping. DT is the fixed baseline; adaptive steps follow the CFL limit
+// of the fastest particle against the local pipe width, and substeps let the
+// few fast particles split their own move instead
+const float CFL_NUMBER = 0.25f;
+const float MIN_STEP = DT / 64.0f;
+const float MAX_STEP = 8.0f * DT;
+const int MAX_SUBSTEPS = 8;
+const float FRAME_TIME = DT;  // Simulated time between two rendered frames
+bool adaptiveStepping = false;
+bool particleSubsteps = false;
+float timeStep = DT;
+double simulationTime = 0.0;
+float injectionCarry = 0.0f;
+
 std::mt19937 rng(std::random_device{}());
 std::uniform_real_distribution<float> rand01(0.0f, 1.0f);
 std::uniform_real_distribution<float> randSymmetric(-0.01f, 0.01f);
@@ -18,6 +43,7 @@ std::uniform_real_distribution<float> randSymmetric(-0.01f, 0.01f);
 // Particle structure
 struct Particle {
 	float x, y, vx, vy;
+	float birth = 0.0f;  // Simulated time of injection, for residence times
 };
 
 std::vector<Particle> particles;
@@ -32,32 +58,433 @@ float pipeWidth(float x) {
 void initParticles() {
 	particles.clear();
 	particles.reserve(NUM_PARTICLES);
+	simulationTime = 0.0;
+	injectionCarry = 0.0f;
 }
 
-// Inject new particles at the left boundary
-void injectParticles() {
-	for (int i = 0; i < INJECTION_RATE; i++) {
-		float y = (rand01(rng) - 0.5f) * pipeWidth(0);
-		float vx = 0.2f + 0.1f * rand01(rng);
-		particles.push_back({0.0f, y, vx, 0.0f});
+// Pick the step from the CFL limit, never stepping over until
+void chooseTimeStep(double until) {
+	if (!adaptiveStepping) {
+		timeStep = DT;
+		return;
 	}
+	float limit = HUGE_VALF;
+	for (const auto &p : particles) {
+		float speed = std::sqrt(p.vx * p.vx + p.vy * p.vy);
+		limit = std::min(limit, pipeWidth(p.x) / std::max(speed, 1e-6f));
+	}
+	limit *= CFL_NUMBER;
+	if (particleSubsteps) limit *= MAX_SUBSTEPS;
+	timeStep = std::min(std::max(limit, MIN_STEP), MAX_STEP);
+
+	double remaining = until - simulationTime;
+	if (remaining < double(timeStep) + MIN_STEP) timeStep = float(std::max(remaining, double(MIN_STEP)));
 }
 
-// Monte Carlo step with pressure-driven flow
-void updateParticles() {
-	std::vector<Particle> newParticles;
-	newParticles.reserve(particles.size());
+// Substeps a particle needs to cross at most CFL_NUMBER local widths per substep
+int substepCount(const Particle &p, float width, float dt) {
+	if (!particleSubsteps) return 1;
+	float travel = dt * std::sqrt(p.vx * p.vx + p.vy * p.vy);
+	float allowed = CFL_NUMBER * width;
+	if (travel <= allowed) return 1;
+	return std::min(MAX_SUBSTEPS, int(std::ceil(travel / allowed)));
+}
 
-	for (auto &p : particles) {
-		float width = pipeWidth(p.x);
-		float pressureBoost = (PRESSURE_FORCE / width) * DT;
-		p.vx = std::min(p.vx + pressureBoost, MAX_VELOCITY);
-		p.vx += randSymmetric(rng);
-		p.vy += randSymmetric(rng);
+// Streaming flow diagnostics, gathered inside the update loop: net crossings
+// of each cross-section, time-weighted occupancy and velocity of a thin band
+// around it (overall and binned across the local width), and the residence
+// time of each particle leaving the pipe
+const int MAX_SECTIONS = 16;
+const int PROFILE_BINS = 16;
+const float SECTION_BAND = 0.01f;  // Half width in x of the band around a section
+
+std::vector<float> sectionX = {0.1f, 0.3f, 0.5f, 0.7f, 0.9f};
+float sectionHalfWidth[MAX_SECTIONS];
+bool flowDiagnostics = false;
+
+struct FlowAccumulator {
+	double crossings[MAX_SECTIONS];  // Net left-to-right crossings
+	double occupancy[MAX_SECTIONS];  // Particle-time spent in the band
+	double sumVx[MAX_SECTIONS], sumVy[MAX_SECTIONS];
+	double binOccupancy[MAX_SECTIONS][PROFILE_BINS];
+	double binVx[MAX_SECTIONS][PROFILE_BINS], binVy[MAX_SECTIONS][PROFILE_BINS];
+	double exited, residenceSum, residenceSquares, residenceMax;
+
+	void clear() { std::memset(static_cast<void *>(this), 0, sizeof(*this)); }
+
+	// One particle moving from (x0, y0) to (x, y) over a step of dt, taken as a
+	// straight segment at constant velocity. The band statistics weigh that
+	// velocity by the time the segment spends inside the band, so a particle
+	// passing through adds the same flux as its crossing
+	void add(float x0, float y0, float x, float y, float birth, float dt) {
+		double vx = (double(x) - x0) / dt, vy = (double(y) - y0) / dt;
+		double lo = std::min(x0, x), hi = std::max(x0, x);
+		for (size_t k = 0; k < sectionX.size(); ++k) {
+			float xs = sectionX[k];
+			crossings[k] += (x0 < xs && x >= xs) ? 1.0 : (x0 >= xs && x < xs) ? -1.0 : 0.0;
+			double enter = std::max(lo, double(xs) - SECTION_BAND), leave = std::min(hi, double(xs) + SECTION_BAND);
+			double inside;  // Fraction of the step spent in the band
+			if (hi > lo) inside = std::max(leave - enter, 0.0) / (hi - lo);
+			else inside = std::abs(x - xs) < SECTION_BAND ? 1.0 : 0.0;
+			if (inside <= 0.0) continue;
+			double w = dt * inside;
+			occupancy[k] += w;
+			sumVx[k] += w * vx;
+			sumVy[k] += w * vy;
+			// Bin by the height halfway through the part of the segment in the band
+			double yMid = hi > lo ? y0 + (y - y0) * ((enter + leave) / 2.0 - x0) / (double(x) - x0) : y;
+			int bin = std::min(std::max(int((yMid / sectionHalfWidth[k] + 1.0) * 0.5 * PROFILE_BINS), 0), PROFILE_BINS - 1);
+			binOccupancy[k][bin] += w;
+			binVx[k][bin] += w * vx;
+			binVy[k][bin] += w * vy;
+		}
+		if (x >= PIPE_LENGTH) {
+			double residence = simulationTime - birth;
+			exited += 1.0;
+			residenceSum += residence;
+			residenceSquares += residence * residence;
+			residenceMax = std::max(residenceMax, residence);
+		}
+	}
+
+	void merge(const FlowAccumulator &other) {
+		const double *from = &other.crossings[0];
+		double *to = &crossings[0];
+		size_t sums = offsetof(FlowAccumulator, residenceMax) / sizeof(double);
+		for (size_t k = 0; k < sums; ++k) to[k] += from[k];
+		residenceMax = std::max(residenceMax, other.residenceMax);
+	}
+};
+
+static_assert(std::is_trivially_copyable<FlowAccumulator>::value, "flow records are written raw");
+
+FlowAccumulator flowWindow;  // Since the last record
+
+enum class FlowFormat { Tsv, Binary };
+
+// Header of the binary flow file, followed by one FlowRecordHeader plus the
+// reduced FlowAccumulator per record
+struct FlowFileHeader {
+	char magic[8];  // "FFLOW\0\0\0"
+	uint32_t version;
+	uint32_t sections;
+	uint32_t profileBins;
+	float band;
+	float sectionX[MAX_SECTIONS];
+	float sectionWidth[MAX_SECTIONS];
+};
+
+struct FlowRecordHeader {
+	int64_t step;
+	double time;
+	double duration;  // Simulated time the record covers
+};
+
+// Writes the accumulated window every `every` steps as one record:
+// TSV tables PREFIX-flux.tsv, PREFIX-profile.tsv and PREFIX-residence.tsv, or
+// the raw sums in PREFIX.fflow. The flux table sets the measured flux beside
+// density * width * mean vx, the two sides of the continuity equation
+class FlowRecorder {
+public:
+	~FlowRecorder() { finish(); }
+
+	bool start(const std::string &prefix, FlowFormat outputFormat, long recordEvery) {
+		format = outputFormat;
+		every = std::max(1L, recordEvery);
+		if (sectionX.size() > size_t(MAX_SECTIONS)) sectionX.resize(MAX_SECTIONS);
+		for (size_t k = 0; k < sectionX.size(); ++k) sectionHalfWidth[k] = pipeWidth(sectionX[k]) / 2.0f;
+		flowWindow.clear();
+		window.clear();
+		run.clear();
+		windowStart = runStart = simulationTime;
+		steps = 0;
+
+		if (format == FlowFormat::Binary) {
+			binary.open(prefix + ".fflow", std::ios::binary);
+			FlowFileHeader h = {};
+			std::memcpy(h.magic, "FFLOW\0\0\0", sizeof(h.magic));
+			h.version = 1;
+			h.sections = uint32_t(sectionX.size());
+			h.profileBins = PROFILE_BINS;
+			h.band = SECTION_BAND;
+			for (size_t k = 0; k < sectionX.size(); ++k) {
+				h.sectionX[k] = sectionX[k];
+				h.sectionWidth[k] = 2.0f * sectionHalfWidth[k];
+			}
+			binary.write(reinterpret_cast<const char *>(&h), sizeof(h));
+		} else {
+			flux.open(prefix + "-flux.tsv");
+			profile.open(prefix + "-profile.tsv");
+			residence.open(prefix + "-residence.tsv");
+			flux << "step\ttime\tsection\tx\twidth\tcrossings\tflux\tdensity\tmean_vx\tmean_vy\tarea_velocity\tdensity_area_velocity\n";
+			profile << "step\ttime\tsection\tx\tbin\ty_over_half_width\tdensity\tmean_vx\tmean_vy\n";
+			residence << "step\ttime\texited\tmean\tstddev\tmax\n";
+		}
+		if (!(format == FlowFormat::Binary ? bool(binary) : flux && profile && residence)) {
+			std::cerr << "Cannot open flow diagnostics output " << prefix << "\n";
+			return false;
+		}
+		flowDiagnostics = true;
+		return true;
+	}
+
+	bool running() const { return flowDiagnostics; }
+
+	// Called after every step; writes when a record is due
+	void stepped() {
+		if (++steps % every == 0) record();
+	}
+
+	// Write the last partial record and print the whole-run continuity check
+	void finish() {
+		if (!flowDiagnostics) return;
+		if (simulationTime > windowStart) record();
+		flowDiagnostics = false;
+		double duration = simulationTime - runStart;
+		bool reached = false;
+		std::cerr << "section\tx\twidth\tflux\tdensity_area_velocity\n";
+		for (size_t k = 0; k < sectionX.size(); ++k) {
+			double width = 2.0 * sectionHalfWidth[k];
+			double density = run.occupancy[k] / (duration * 2.0 * SECTION_BAND * width);
+			double meanVx = run.sumVx[k] / std::max(run.occupancy[k], 1e-300);
+			std::cerr << k << "\t" << sectionX[k] << "\t" << width << "\t" << run.crossings[k] / duration << "\t"
+				<< density * width * meanVx << "\n";
+			reached = reached || run.occupancy[k] > 0.0;
+		}
+		// A stalled flow leaves both columns at zero, which is not a passed check
+		if (!reached) std::cerr << "No particle reached a section band, the continuity check is empty\n";
+	}
+
+private:
+	void record() {
+		window = flowWindow;
+		flowWindow.clear();
+		run.merge(window);
+		double duration = simulationTime - windowStart;
+		windowStart = simulationTime;
+		if (duration <= 0.0) return;
+
+		if (format == FlowFormat::Binary) {
+			FlowRecordHeader h = {steps, simulationTime, duration};
+			binary.write(reinterpret_cast<const char *>(&h), sizeof(h));
+			binary.write(reinterpret_cast<const char *>(&window), sizeof(window));
+			return;
+		}
+
+		for (size_t k = 0; k < sectionX.size(); ++k) {
+			double width = 2.0 * sectionHalfWidth[k];
+			double density = window.occupancy[k] / (duration * 2.0 * SECTION_BAND * width);
+			double occupied = std::max(window.occupancy[k], 1e-300);
+			double meanVx = window.sumVx[k] / occupied, meanVy = window.sumVy[k] / occupied;
+			flux << steps << "\t" << simulationTime << "\t" << k << "\t" << sectionX[k] << "\t" << width << "\t"
+				<< window.crossings[k] << "\t" << window.crossings[k] / duration << "\t" << density << "\t" << meanVx << "\t"
+				<< meanVy << "\t" << width * meanVx << "\t" << density * width * meanVx << "\n";
+
+			double binArea = duration * 2.0 * SECTION_BAND * width / PROFILE_BINS;
+			for (int b = 0; b < PROFILE_BINS; ++b) {
+				double binOccupied = std::max(window.binOccupancy[k][b], 1e-300);
+				profile << steps << "\t" << simulationTime << "\t" << k << "\t" << sectionX[k] << "\t" << b << "\t"
+					<< (b + 0.5) * 2.0 / PROFILE_BINS - 1.0 << "\t" << window.binOccupancy[k][b] / binArea << "\t"
+					<< window.binVx[k][b] / binOccupied << "\t" << window.binVy[k][b] / binOccupied << "\n";
+			}
+		}
+		double exited = std::max(window.exited, 1.0);
+		double mean = window.residenceSum / exited;
+		double variance = std::max(window.residenceSquares / exited - mean * mean, 0.0);
+		residence << steps << "\t" << simulationTime << "\t" << window.exited << "\t" << mean << "\t"
+			<< std::sqrt(variance) << "\t" << window.residenceMax << "\n";
+	}
+
+	FlowFormat format = FlowFormat::Tsv;
+	long every = 100;
+	long steps = 0;
+	std::ofstream binary, flux, profile, residence;
+	FlowAccumulator window, run;
+	double windowStart = 0.0, runStart = 0.0;
+};
+
+FlowRecorder flowRecorder;
+
+// Optional hard-disk collisions between particles. Each particle gets the
+// Morton code of its grid cell (cells one diameter wide) and the codes are
+// radix sorted. Any aligned 2 x 2 block of cells is then one run of the sorted
+// order, and four such runs cover a particle's 3 x 3 neighborhood. Every
+// particle sums the impulses of all its contacts into its own slot of a second
+// array, so every response sees the state from before the pass
+bool particleCollisions = false;
+float collisionRadius = 0.002f;
+const float COLLISION_RESTITUTION = 1.0f;  // Elastic disks
+const int MORTON_AXIS_BITS = 24;           // Cells per axis before the grid coarsens
+
+struct MortonGrid {
+	float x0 = 0.0f, y0 = 0.0f;
+	float invCell = 1.0f;
+	int nx = 1, ny = 1;
+
+	int cellX(float x) const { return std::min(std::max(int((x - x0) * invCell), 0), nx - 1); }
+	int cellY(float y) const { return std::min(std::max(int((y - y0) * invCell), 0), ny - 1); }
+} mortonGrid;
+
+std::vector<uint64_t> mortonKeys, mortonKeysScratch;
+std::vector<uint32_t> mortonOrder, mortonOrderScratch;
+std::vector<Particle> collided;
+
+// Interleave the low 32 bits of v with zeros
+inline uint64_t spreadBits(uint64_t v) {
+	v &= 0xffffffffull;
+	v = (v | v << 16) & 0x0000ffff0000ffffull;
+	v = (v | v << 8) & 0x00ff00ff00ff00ffull;
+	v = (v | v << 4) & 0x0f0f0f0f0f0f0f0full;
+	v = (v | v << 2) & 0x3333333333333333ull;
+	v = (v | v << 1) & 0x5555555555555555ull;
+	return v;
+}
+
+inline uint64_t mortonCode(int cx, int cy) {
+	return spreadBits(uint64_t(cx)) | spreadBits(uint64_t(cy)) << 1;
+}
+
+// Fit the grid to the particles, code them and sort the codes with a stable
+// 8 bit least-significant-digit radix sort, skipping digits no code uses
+void sortMorton() {
+	size_t n = particles.size();
+	float minX = HUGE_VALF, maxX = -HUGE_VALF, minY = HUGE_VALF, maxY = -HUGE_VALF;
+	for (const auto &p : particles) {
+		minX = std::min(minX, p.x);
+		maxX = std::max(maxX, p.x);
+		minY = std::min(minY, p.y);
+		maxY = std::max(maxY, p.y);
+	}
+	int maxCells = 1 << MORTON_AXIS_BITS;
+	float cell = std::max(2.0f * collisionRadius, std::max(maxX - minX, maxY - minY) / float(maxCells - 1));
+	mortonGrid.x0 = minX;
+	mortonGrid.y0 = minY;
+	mortonGrid.invCell = 1.0f / cell;
+	mortonGrid.nx = std::min(int((maxX - minX) * mortonGrid.invCell) + 1, maxCells);
+	mortonGrid.ny = std::min(int((maxY - minY) * mortonGrid.invCell) + 1, maxCells);
+
+	mortonKeys.resize(n);
+	mortonOrder.resize(n);
+	mortonKeysScratch.resize(n);
+	mortonOrderScratch.resize(n);
+	for (size_t i = 0; i < n; ++i) {
+		mortonKeys[i] = mortonCode(mortonGrid.cellX(particles[i].x), mortonGrid.cellY(particles[i].y));
+		mortonOrder[i] = uint32_t(i);
+	}
+
+	uint64_t maxKey = mortonCode(mortonGrid.nx - 1, mortonGrid.ny - 1);
+	for (int shift = 0; shift < 64 && (maxKey >> shift) != 0; shift += 8) {
+		size_t offset[256] = {};
+		for (size_t i = 0; i < n; ++i) ++offset[(mortonKeys[i] >> shift) & 255];
+		if (std::find(offset, offset + 256, n) != offset + 256) continue;  // Same digit everywhere
+		size_t total = 0;
+		for (size_t &count : offset) {
+			size_t c = count;
+			count = total;
+			total += c;
+		}
+		for (size_t i = 0; i < n; ++i) {
+			size_t slot = offset[(mortonKeys[i] >> shift) & 255]++;
+			mortonKeysScratch[slot] = mortonKeys[i];
+			mortonOrderScratch[slot] = mortonOrder[i];
+		}
+		mortonKeys.swap(mortonKeysScratch);
+		mortonOrder.swap(mortonOrderScratch);
+	}
+}
+
+// First sorted position whose code is not below code, galloping out from
+// position k: Morton neighbors usually sit close to k in the sorted order
+size_t findMortonRun(uint64_t code, size_t k, size_t n) {
+	const uint64_t *keys = mortonKeys.data();
+	size_t lo, hi, step = 1;
+	if (keys[k] < code) {
+		lo = hi = k + 1;
+		while (hi < n && keys[hi] < code) {
+			lo = hi + 1;
+			hi = k + (step *= 2);
+		}
+		hi = std::min(hi, n);
+	} else {
+		lo = hi = k;
+		while (lo > 0 && keys[lo - 1] >= code) {
+			hi = lo - 1;
+			lo = k >= (step *= 2) ? k - step : 0;
+		}
+	}
+	return std::lower_bound(keys + lo, keys + hi, code) - keys;
+}
 
+// Narrow phase: elastic impulse against every approaching disk in contact
+// plus half the overlap as a push apart
+void resolveCollisions() {
+	size_t n = particles.size();
+	float diameter = 2.0f * collisionRadius;
+	for (size_t k = 0; k < n; ++k) {
+		Particle p = particles[mortonOrder[k]];
+		float dvx = 0.0f, dvy = 0.0f, shiftX = 0.0f, shiftY = 0.0f;
+		int cx = mortonGrid.cellX(p.x), cy = mortonGrid.cellY(p.y);
+		// The 3 x 3 neighborhood lies within at most 2 x 2 aligned blocks of 2 x 2
+		// cells, and each such block is four consecutive codes: one run to search
+		for (int by = std::max(cy - 1, 0) >> 1; by <= std::min(cy + 1, mortonGrid.ny - 1) >> 1; ++by) {
+			for (int bx = std::max(cx - 1, 0) >> 1; bx <= std::min(cx + 1, mortonGrid.nx - 1) >> 1; ++bx) {
+				uint64_t code = mortonCode(2 * bx, 2 * by);
+				for (size_t m = findMortonRun(code, k, n); m < n && mortonKeys[m] < code + 4; ++m) {
+					const Particle &q = particles[mortonOrder[m]];
+					float dx = p.x - q.x, dy = p.y - q.y;
+					float r2 = dx * dx + dy * dy;
+					if (m == k || r2 >= diameter * diameter || r2 == 0.0f) continue;
+					float distance = std::sqrt(r2);
+					float nx = dx / distance, ny = dy / distance;
+					float approach = (p.vx - q.vx) * nx + (p.vy - q.vy) * ny;
+					if (approach < 0.0f) {
+						float impulse = -0.5f * (1.0f + COLLISION_RESTITUTION) * approach;
+						dvx += impulse * nx;
+						dvy += impulse * ny;
+					}
+					float push = 0.5f * (diameter - distance);
+					shiftX += push * nx;
+					shiftY += push * ny;
+				}
+			}
+		}
+
+		float shift2 = shiftX * shiftX + shiftY * shiftY;
+		if (shift2 > collisionRadius * collisionRadius) {  // At most one radius per step
+			float scale = collisionRadius / std::sqrt(shift2);
+			shiftX *= scale;
+			shiftY *= scale;
+		}
+		float halfWidth = pipeWidth(p.x + shiftX) / 2.0f;
+		collided[mortonOrder[k]] = {p.x + shiftX, std::min(std::max(p.y + shiftY, -halfWidth), halfWidth), p.vx + dvx, p.vy + dvy, p.birth};
+	}
+}
+
+void collideParticles() {
+	size_t n = particles.size();
+	if (n == 0) return;
+	sortMorton();
+	collided.resize(n);
+	resolveCollisions();
+	particles.swap(collided);
+}
+
+// Pressure boost, random kick and move of one particle over a step of dt,
+// held inside the walls of the section it starts in
+void stepParticle(Particle &p, float dt) {
+	float width = pipeWidth(p.x);
+	float pressureBoost = (PRESSURE_FORCE / width) * dt;
+	float kickScale = std::sqrt(dt / DT);  // Random walk: kick variance grows linearly with the step
+	p.vx = std::min(p.vx + pressureBoost, MAX_VELOCITY);
+	p.vx += randSymmetric(rng) * kickScale;
+	p.vy += randSymmetric(rng) * kickScale;
+
+	int substeps = substepCount(p, width, dt);
+	float h = dt / substeps;
+	for (int k = 0; k < substeps; ++k) {
 		// Move particle
-		p.x += p.vx * DT;
-		p.y += p.vy * DT;
+		p.x += p.vx * h;
+		p.y += p.vy * h;
 
 		// Constrain within pipe
 		float halfWidth = width / 2.0f;
@@ -65,6 +492,42 @@ void updateParticles() {
 			p.y = std::copysign(halfWidth, p.y);
 			p.vy *= -0.5f; // Damping
 		}
+	}
+}
+
+// Inject new particles at the left boundary, at the same rate per simulated
+// time for any step. A step past DT injects the batches of several fixed steps
+// at once: every INJECTION_RATE particles after the first are one DT older and
+// take those DTs first, so the inlet fills as in the fixed-DT run instead of
+// piling up at x = 0
+void injectParticles() {
+	float due = INJECTION_RATE * (timeStep / DT) + injectionCarry;
+	int count = int(due);
+	injectionCarry = due - float(count);
+	for (int i = 0; i < count; i++) {
+		float y = (rand01(rng) - 0.5f) * pipeWidth(0);
+		float vx = 0.2f + 0.1f * rand01(rng);
+		Particle p = {0.0f, y, vx, 0.0f, float(simulationTime)};
+		int age = int(i / INJECTION_RATE);
+		for (int k = 0; k < age; ++k) stepParticle(p, DT);
+		p.birth = float(simulationTime - age * DT);
+		particles.push_back(p);
+	}
+}
+
+// Monte Carlo step with pressure-driven flow
+void updateParticles(double until = HUGE_VAL) {
+	chooseTimeStep(until);
+	simulationTime += timeStep;
+
+	std::vector<Particle> newParticles;
+	newParticles.reserve(particles.size());
+
+	for (auto &p : particles) {
+		float x0 = p.x, y0 = p.y;
+		stepParticle(p, timeStep);
+
+		if (flowDiagnostics) flowWindow.add(x0, y0, p.x, p.y, p.birth, timeStep);
 
 		// Remove particles at the right boundary, keep the rest
 		if (p.x < PIPE_LENGTH) {
@@ -74,6 +537,101 @@ void updateParticles() {
 
 	particles = std::move(newParticles);
 	injectParticles();
+	if (particleCollisions) collideParticles();
+	if (flowDiagnostics) flowRecorder.stepped();
+}
+
+// Fixed-timestep accumulator for rendering: take steps of whatever size until
+// the next frame boundary FRAME_TIME of simulated time later
+void advanceFrame() {
+	double frameEnd = simulationTime + FRAME_TIME;
+	do {
+		updateParticles(frameEnd);
+	} while (simulationTime < frameEnd - 1e-3 * MIN_STEP);
+}
+
+// Particle statistics for headless runs, one TSV row per call
+void printStats(long step) {
+	double sumVx = 0.0, sumVy = 0.0, maxSpeed = 0.0;
+	for (const auto &p : particles) {
+		sumVx += p.vx;
+		sumVy += p.vy;
+		maxSpeed = std::max(maxSpeed, double(std::hypot(p.vx, p.vy)));
+	}
+	double n = std::max<double>(particles.size(), 1.0);
+	std::cout << step << "\t" << simulationTime << "\t" << particles.size() << "\t" << sumVx / n << "\t" << sumVy / n
+		<< "\t" << maxSpeed << "\n";
+}
+
+// Advance the simulation without any GL context, as fast as it will go
+void runHeadless(long steps, long statsEvery) {
+	initParticles();
+	std::cout << "step\ttime\tparticles\tmean_vx\tmean_vy\tmax_speed\n";
+	printStats(0);
+
+	double updates = 0.0;
+	auto t0 = std::chrono::steady_clock::now();
+	for (long step = 1; step <= steps; ++step) {
+		updates += particles.size();
+		updateParticles();
+		if (statsEvery > 0 && step % statsEvery == 0) printStats(step);
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+	std::cerr << steps << " steps in " << seconds << " s: " << steps / seconds << " steps/s, "
+		<< updates / seconds << " particle-updates/s\n";
+}
+
+// Wall-clock time to reach simulated time T with the fixed DT, the CFL stepper
+// and the CFL stepper with substeps, all from the same seed. The second half of
+// every run is sampled every few DT into a density profile along the pipe; its
+// error is relative to the fixed-DT run, and a fixed run from another seed
+// gives the noise floor
+void compareStepping(double T) {
+	struct Stepping {
+		const char *name;
+		bool adaptive, substeps;
+		unsigned seed;
+	} configs[4] = {{"fixed", false, false, 12345}, {"fixed_reseeded", false, false, 12346},
+		{"adaptive", true, false, 12345}, {"substeps", true, true, 12345}};
+	const int SLICES = 20;
+	double density[4][SLICES] = {};
+
+	// Sample every few DT so the fixed runs land on the sample times too
+	double every = DT * std::max(1.0, std::floor(T / DT / 40.0));
+	std::cout << "stepping\tsteps\tseconds\tparticles\tmean_vx\tspeedup\tdensity_error\n";
+	double baseline = 0.0;
+	for (int c = 0; c < 4; ++c) {
+		const Stepping &config = configs[c];
+		adaptiveStepping = config.adaptive;
+		particleSubsteps = config.substeps;
+		rng.seed(config.seed);
+		initParticles();
+
+		long steps = 0;
+		double seconds = 0.0;
+		for (double sample = every; sample < T + 0.5 * every; sample += every) {
+			double until = std::min(sample, T);
+			auto t0 = std::chrono::steady_clock::now();
+			for (; simulationTime < until - 1e-3 * MIN_STEP; ++steps) updateParticles(until);
+			seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+			if (until < 0.5 * T) continue;
+			for (const auto &p : particles) {
+				density[c][std::min(std::max(int(p.x / PIPE_LENGTH * SLICES), 0), SLICES - 1)] += 1.0;
+			}
+		}
+		if (c == 0) baseline = seconds;
+
+		double sumVx = 0.0, error = 0.0, total = 0.0;
+		for (const auto &p : particles) sumVx += p.vx;
+		for (int k = 0; k < SLICES; ++k) {
+			error += std::abs(density[c][k] - density[0][k]);
+			total += density[0][k];
+		}
+		std::cout << config.name << "\t" << steps << "\t" << seconds << "\t" << particles.size() << "\t"
+			<< sumVx / std::max<double>(particles.size(), 1.0) << "\t" << baseline / seconds << "\t"
+			<< error / std::max(total, 1.0) << "\n";
+	}
 }
 
 // Render pipe walls
@@ -103,33 +661,397 @@ void renderParticles() {
 	glEnd();
 }
 
+// Points draws every particle; Density bins them into a screen-sized
+// histogram and draws a single texture, so the render cost
+// follows the resolution rather than the particle count
+enum class RenderMode { Points, Density };
+RenderMode renderMode = RenderMode::Points;
+
+const float VIEW_X0 = 0.0f, VIEW_X1 = PIPE_LENGTH;  // Visible part of the pipe
+const float VIEW_Y0 = -0.3f, VIEW_Y1 = 0.3f;
+
+struct DensityMap {
+	int width = 0, height = 0;
+	std::vector<float> bins;      // width * height (count, summed |vx|) pairs
+	std::vector<uint32_t> image;  // Colormapped RGBA8, bottom row first
+	GLuint texture = 0;
+} density;
+
+// Histogram the particles and colormap the bins: brightness is log density,
+// hue the mean |vx| like the points
+void binDensity(int width, int height) {
+	size_t pixels = size_t(width) * height;
+	std::vector<float> &total = density.bins;
+	total.assign(pixels * 2, 0.0f);
+	density.image.resize(pixels);
+
+	float sx = width / (VIEW_X1 - VIEW_X0), sy = height / (VIEW_Y1 - VIEW_Y0);
+	for (const Particle &p : particles) {
+		float u = (p.x - VIEW_X0) * sx, v = (p.y - VIEW_Y0) * sy;
+		if (!(u >= 0.0f && u < width && v >= 0.0f && v < height)) continue;
+		size_t pixel = size_t(v) * width + size_t(u);
+		total[2 * pixel] += 1.0f;
+		total[2 * pixel + 1] += std::abs(p.vx);
+	}
+
+	float peak = 1.0f;
+	for (size_t k = 0; k < pixels * 2; k += 2) peak = std::max(peak, total[k]);
+
+	float scale = 255.0f / std::log1p(peak);
+	for (size_t pixel = 0; pixel < pixels; ++pixel) {
+		float count = total[2 * pixel];
+		if (count == 0.0f) {
+			density.image[pixel] = 0xff000000u;
+			continue;
+		}
+		float intensity = std::log1p(count) * scale;
+		float speedFactor = std::min(1.0f, total[2 * pixel + 1] / count / MAX_VELOCITY);
+		uint32_t r = uint32_t(intensity * (1.0f - speedFactor)), g = uint32_t(intensity), b = uint32_t(intensity * speedFactor);
+		density.image[pixel] = r | g << 8 | b << 16 | 0xff000000u;  // RGBA bytes in memory order
+	}
+}
+
+// Bin at framebuffer resolution, upload and stretch the texture over the view
+void renderDensity(int width, int height) {
+	binDensity(width, height);
+	if (!density.texture) glGenTextures(1, &density.texture);
+	glBindTexture(GL_TEXTURE_2D, density.texture);
+	if (width != density.width || height != density.height) {
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, density.image.data());
+		density.width = width;
+		density.height = height;
+	} else {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, density.image.data());
+	}
+
+	glEnable(GL_TEXTURE_2D);
+	glColor3f(1.0f, 1.0f, 1.0f);
+	glBegin(GL_QUADS);
+	glTexCoord2f(0.0f, 0.0f); glVertex2f(VIEW_X0, VIEW_Y0);
+	glTexCoord2f(1.0f, 0.0f); glVertex2f(VIEW_X1, VIEW_Y0);
+	glTexCoord2f(1.0f, 1.0f); glVertex2f(VIEW_X1, VIEW_Y1);
+	glTexCoord2f(0.0f, 1.0f); glVertex2f(VIEW_X0, VIEW_Y1);
+	glEnd();
+	glDisable(GL_TEXTURE_2D);
+}
+
 // OpenGL display function
-void display() {
+void display(GLFWwindow *window) {
 	glClear(GL_COLOR_BUFFER_BIT);
+	if (renderMode == RenderMode::Density) {
+		int width, height;
+		glfwGetFramebufferSize(window, &width, &height);
+		if (width > 0 && height > 0) renderDensity(width, height);
+		renderPipe();
+		return;
+	}
 	renderPipe();
 	renderParticles();
 }
 
-// Main function
-int main() {
+const int EXPORT_QUEUE_DEPTH = 8;  // Frames in flight between the readback and the encoder
+
+enum class ExportFormat { Ppm, Y4m };
+
+// Encodes exported frames on its own thread. The producer copies raw RGB
+// rows (bottom row first, as glReadPixels returns them) into a free slot and
+// queues it; the encoder flips and writes them in order, one PPM per frame
+// or a single 4:4:4 Y4M stream. A full queue makes the producer wait rather
+// than drop frames, and the wait is reported
+class FrameExporter {
+public:
+	~FrameExporter() { finish(); }
+
+	bool start(const std::string &pathPrefix, ExportFormat exportFormat, int frameWidth, int frameHeight, int fps) {
+		prefix = pathPrefix;
+		format = exportFormat;
+		width = frameWidth;
+		height = frameHeight;
+		for (Slot &slot : slots) slot.rgb.resize(size_t(width) * height * 3);
+		if (format == ExportFormat::Y4m) {
+			stream.open(prefix + ".y4m", std::ios::binary);
+			if (!stream) {
+				std::cerr << "Cannot open " << prefix << ".y4m\n";
+				return false;
+			}
+			stream << "YUV4MPEG2 W" << width << " H" << height << " F" << fps << ":1 Ip A1:1 C444\n";
+			planes.resize(size_t(width) * height * 3);
+		}
+		stopping = false;
+		started = std::chrono::steady_clock::now();
+		encoder = std::thread([this] { loop(); });
+		return true;
+	}
+
+	// Free slot for the next frame, waiting for the encoder if all are queued
+	uint8_t *claim() {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			for (int k = 0; k < EXPORT_QUEUE_DEPTH; ++k) {
+				if (slots[k].state == Free) {
+					slots[k].state = Filling;
+					filling = k;
+					return slots[k].rgb.data();
+				}
+			}
+			auto t0 = std::chrono::steady_clock::now();
+			wake.wait(lock);
+			waited += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		}
+	}
+
+	void submit() {
+		std::lock_guard<std::mutex> lock(mutex);
+		slots[filling].sequence = submitted++;
+		slots[filling].state = Queued;
+		wake.notify_all();
+	}
+
+	// Drain the queue, stop the encoder and report the achieved export rate
+	void finish() {
+		if (!encoder.joinable()) return;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		encoder.join();
+		stream.close();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+		std::cerr << written << " frames exported in " << seconds << " s: " << written / seconds << " fps (encoder busy "
+			<< encoding << " s, producer waited " << waited << " s on a full queue)\n";
+	}
+
+private:
+	enum SlotState { Free, Filling, Queued };
+
+	struct Slot {
+		std::vector<uint8_t> rgb;
+		long sequence = 0;
+		SlotState state = Free;
+	};
+
+	void loop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			int slot = -1;
+			for (int k = 0; k < EXPORT_QUEUE_DEPTH; ++k) {
+				if (slots[k].state == Queued && (slot < 0 || slots[k].sequence < slots[slot].sequence)) slot = k;
+			}
+			if (slot < 0) {
+				if (stopping) return;
+				wake.wait(lock);
+				continue;
+			}
+			lock.unlock();
+
+			auto t0 = std::chrono::steady_clock::now();
+			write(slots[slot]);
+			double busy = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+			lock.lock();
+			encoding += busy;
+			++written;
+			slots[slot].state = Free;
+			wake.notify_all();
+		}
+	}
+
+	void write(const Slot &slot) {
+		size_t rowBytes = size_t(width) * 3;
+		if (format == ExportFormat::Ppm) {
+			std::string digits = std::to_string(slot.sequence);
+			std::string path = prefix + "-" + std::string(digits.size() < 8 ? 8 - digits.size() : 0, '0') + digits + ".ppm";
+			std::ofstream out(path, std::ios::binary);
+			out << "P6\n" << width << " " << height << "\n255\n";
+			for (int y = height - 1; y >= 0; --y) {
+				out.write(reinterpret_cast<const char *>(&slot.rgb[y * rowBytes]), rowBytes);
+			}
+			if (!out) std::cerr << "Failed to write frame " << path << "\n";
+			return;
+		}
+
+		// BT.601 studio range, full resolution chroma planes
+		size_t plane = size_t(width) * height;
+		for (int y = 0; y < height; ++y) {
+			const uint8_t *rgb = &slot.rgb[(height - 1 - y) * rowBytes];
+			for (int x = 0; x < width; ++x) {
+				int r = rgb[3 * x], g = rgb[3 * x + 1], b = rgb[3 * x + 2];
+				size_t pixel = size_t(y) * width + x;
+				planes[pixel] = uint8_t(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+				planes[plane + pixel] = uint8_t(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+				planes[2 * plane + pixel] = uint8_t(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+			}
+		}
+		stream << "FRAME\n";
+		stream.write(reinterpret_cast<const char *>(planes.data()), planes.size());
+		if (!stream) std::cerr << "Failed to write frame " << slot.sequence << " to " << prefix << ".y4m\n";
+	}
+
+	std::string prefix;
+	ExportFormat format = ExportFormat::Ppm;
+	int width = 0, height = 0;
+	std::ofstream stream;
+	std::vector<uint8_t> planes;
+	std::thread encoder;
+	std::mutex mutex;
+	std::condition_variable wake;
+	Slot slots[EXPORT_QUEUE_DEPTH];
+	int filling = -1;
+	long submitted = 0;
+	size_t written = 0;
+	double encoding = 0.0, waited = 0.0;
+	bool stopping = false;
+	std::chrono::steady_clock::time_point started;
+};
+
+// Offline movie: render frames into a hidden window in lockstep with the
+// simulation, FRAME_TIME of simulated time apart, and hand every one to the
+// encoder thread. Only the glReadPixels copy stays on this thread
+int runExport(const std::string &prefix, ExportFormat format, long frames, int fps) {
+	if (!glfwInit()) return -1;
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	GLFWwindow *window = glfwCreateWindow(800, 400, "2D Fluid Simulation export", NULL, NULL);
+	if (!window) { glfwTerminate(); return -1; }
+
+	glfwMakeContextCurrent(window);
+	glOrtho(VIEW_X0, VIEW_X1, VIEW_Y0, VIEW_Y1, -1, 1);
+	int width, height;
+	glfwGetFramebufferSize(window, &width, &height);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadBuffer(GL_BACK);
+
+	initParticles();
+	FrameExporter exporter;
+	if (!exporter.start(prefix, format, width, height, fps)) {
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		return -1;
+	}
+	for (long frame = 0; frame < frames; ++frame) {
+		if (frame > 0) advanceFrame();
+		display(window);
+		glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, exporter.claim());
+		exporter.submit();
+		glfwSwapBuffers(window);
+		glfwPollEvents();
+	}
+	exporter.finish();
+
+	if (density.texture) glDeleteTextures(1, &density.texture);
+	glfwDestroyWindow(window);
+	glfwTerminate();
+	return 0;
+}
+
+// Interactive front end: FRAME_TIME of simulated time per displayed frame
+int runWindowed() {
 	if (!glfwInit()) return -1;
 	GLFWwindow *window = glfwCreateWindow(800, 400, "2D Fluid Simulation", NULL, NULL);
 	if (!window) { glfwTerminate(); return -1; }
 
 	glfwMakeContextCurrent(window);
-	glOrtho(0, PIPE_LENGTH, -0.3, 0.3, -1, 1);
+	glOrtho(VIEW_X0, VIEW_X1, VIEW_Y0, VIEW_Y1, -1, 1);
 
 	initParticles();
 
 	while (!glfwWindowShouldClose(window)) {
-		updateParticles();
-		display();
+		advanceFrame();
+		display(window);
 		glfwSwapBuffers(window);
 		glfwPollEvents();
 	}
 
+	if (density.texture) glDeleteTextures(1, &density.texture);
 	glfwDestroyWindow(window);
 	glfwTerminate();
 	return 0;
 }
 
+const char USAGE[] =
+	" [--headless --steps N --stats-every N] [--adaptive --substeps --compare-stepping --sim-time T]\n"
+	"       [--collisions --collision-radius R] [--render points|density]\n"
+	"       [--diagnostics PREFIX --diagnostics-every N --diagnostics-format tsv|bin --sections X,X,...]\n"
+	"       [--export PREFIX --export-format ppm|y4m --frames N --export-fps N]\n";
+
+// Main function
+int main(int argc, char **argv) {
+	bool headless = false;
+	bool compare = false;
+	long steps = 1000;
+	long statsEvery = 100;
+	double simTime = 1.0;
+	std::string exportPrefix;
+	ExportFormat exportFormat = ExportFormat::Ppm;
+	long exportFrames = 300;
+	int exportFps = 30;
+	std::string flowPrefix;
+	FlowFormat flowFormat = FlowFormat::Tsv;
+	long flowEvery = 100;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--headless") headless = true;
+		else if (arg == "--adaptive") adaptiveStepping = true;
+		else if (arg == "--substeps") adaptiveStepping = particleSubsteps = true;
+		else if (arg == "--compare-stepping") compare = true;
+		else if (arg == "--sim-time" && i + 1 < argc) simTime = std::stod(argv[++i]);
+		else if (arg == "--steps" && i + 1 < argc) steps = std::stol(argv[++i]);
+		else if (arg == "--stats-every" && i + 1 < argc) statsEvery = std::stol(argv[++i]);
+		else if (arg == "--diagnostics" && i + 1 < argc) flowPrefix = argv[++i];
+		else if (arg == "--diagnostics-every" && i + 1 < argc) flowEvery = std::stol(argv[++i]);
+		else if (arg == "--diagnostics-format" && i + 1 < argc) {
+			std::string format = argv[++i];
+			if (format == "tsv") flowFormat = FlowFormat::Tsv;
+			else if (format == "bin") flowFormat = FlowFormat::Binary;
+			else { std::cerr << "Unknown diagnostics format: " << format << " (tsv, bin)\n"; return -1; }
+		}
+		else if (arg == "--sections" && i + 1 < argc) {
+			sectionX.clear();
+			std::string list = argv[++i];
+			for (size_t at = 0; at < list.size();) {
+				size_t comma = std::min(list.find(',', at), list.size());
+				sectionX.push_back(std::stof(list.substr(at, comma - at)));
+				at = comma + 1;
+			}
+		}
+		else if (arg == "--collisions") particleCollisions = true;
+		else if (arg == "--collision-radius" && i + 1 < argc) {
+			particleCollisions = true;
+			collisionRadius = std::stof(argv[++i]);
+		}
+		else if (arg == "--export" && i + 1 < argc) exportPrefix = argv[++i];
+		else if (arg == "--frames" && i + 1 < argc) exportFrames = std::stol(argv[++i]);
+		else if (arg == "--export-fps" && i + 1 < argc) exportFps = std::max(1, std::stoi(argv[++i]));
+		else if (arg == "--export-format" && i + 1 < argc) {
+			std::string format = argv[++i];
+			if (format == "ppm") exportFormat = ExportFormat::Ppm;
+			else if (format == "y4m") exportFormat = ExportFormat::Y4m;
+			else { std::cerr << "Unknown export format: " << format << " (ppm, y4m)\n"; return -1; }
+		}
+		else if (arg == "--render" && i + 1 < argc) {
+			std::string mode = argv[++i];
+			if (mode == "points") renderMode = RenderMode::Points;
+			else if (mode == "density") renderMode = RenderMode::Density;
+			else { std::cerr << "Unknown render mode: " << mode << " (points, density)\n"; return -1; }
+		}
+		else {
+			std::cerr << (i + 1 == argc ? "Unknown argument or missing value: " : "Unknown argument: ") << arg << "\n"
+			          << "usage: " << argv[0] << USAGE;
+			return -1;
+		}
+	}
+
+	if (compare) {
+		compareStepping(simTime);
+		return 0;
+	}
+	if (!flowPrefix.empty() && !flowRecorder.start(flowPrefix, flowFormat, flowEvery)) return -1;
+	int status = 0;
+	if (headless) runHeadless(steps, statsEvery);
+	else if (!exportPrefix.empty()) status = runExport(exportPrefix, exportFormat, exportFrames, exportFps);
+	else status = runWindowed();
+	flowRecorder.finish();
+	return status;
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Complex DFT of one fixed length, planned once and then reused from any
+// number of threads. The length is factored into radix-4, 2, 3, 5 and other
+// small prime stages run Stockham style: each stage reads one buffer and
+// writes the other, and the result comes out in natural order without a
+// bit-reversal pass. A length with a prime factor above MAX_DIRECT_RADIX is
+// done with Bluestein's chirp-z trick as a convolution on a power-of-two
+// plan, which keeps every size O(n log n). Real is float or double
+template <class Real> class BasicFftPlan {
+public:
+	typedef std::complex<Real> Complex;
+
+	static constexpr int MAX_DIRECT_RADIX = 32;
+
+	int size() const { return n; }
+
+	// Complex values forward() and inverse() need as workspace besides the data
+	size_t scratchSize() const { return convolution ? 2 * size_t(convolution->n) : size_t(n); }
+
+	void plan(int length) {
+		n = length;
+		radices.clear();
+		convolution.reset();
+
+		int rest = n;
+		while (rest % 4 == 0) { radices.push_back(4); rest /= 4; }
+		while (rest % 2 == 0) { radices.push_back(2); rest /= 2; }
+		for (int p = 3; rest > 1; p += 2)
+			while (rest % p == 0) { radices.push_back(p); rest /= p; }
+
+		if (!radices.empty() && radices.back() > MAX_DIRECT_RADIX) {
+			radices.clear();
+			planBluestein();
+			return;
+		}
+		roots.resize(n);
+		inverseRoots.resize(n);
+		for (int j = 0; j < n; j++) {
+			roots[j] = Complex(std::polar(1.0, -2.0 * M_PI * j / n));
+			inverseRoots[j] = std::conj(roots[j]);
+		}
+	}
+
+	// In place; scratch holds scratchSize() values
+	void forward(Complex *data, Complex *scratch) const { run<false>(data, scratch); }
+
+	// Unnormalized inverse, the same stages with conjugate twiddles
+	void inverse(Complex *data, Complex *scratch) const {
+		if (!convolution) {
+			run<true>(data, scratch);
+			return;
+		}
+		for (int j = 0; j < n; j++) data[j] = std::conj(data[j]);
+		forwardBluestein(data, scratch);
+		for (int j = 0; j < n; j++) data[j] = std::conj(data[j]);
+	}
+
+private:
+	// std::complex operator* goes through the NaN-checking __mulsc3/__muldc3
+	// call unless the build relaxes complex arithmetic, which the butterflies
+	// cannot afford
+	static Complex mul(Complex a, Complex b) {
+		return {a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real()};
+	}
+
+	template <bool Inverse> void run(Complex *data, Complex *scratch) const {
+		if (convolution) {
+			forwardBluestein(data, scratch);
+			return;
+		}
+		const Complex *w = Inverse ? inverseRoots.data() : roots.data();
+		Complex *x = data, *y = scratch;
+		int stride = 1;
+		for (int radix : radices) {
+			stage<Inverse>(radix, n / stride, stride, w, x, y);
+			std::swap(x, y);
+			stride *= radix;
+		}
+		if (x != data) std::copy(x, x + n, data);
+	}
+
+	// One decimation-in-frequency pass over all stride interleaved
+	// subsequences of length len: element p + t*m of a subsequence feeds
+	// output r*p + u, twiddled by w_len^(p*u) = root[p*u*stride], root being
+	// roots or inverseRoots
+	template <bool Inverse>
+	void stage(int radix, int len, int stride, const Complex *root, const Complex *__restrict x, Complex *__restrict y) const {
+		const int m = len / radix;
+		if (radix == 4) {
+			for (int p = 0; p < m; p++) {
+				const Complex w1 = root[p * stride], w2 = root[2 * p * stride], w3 = root[3 * p * stride];
+				for (int q = 0; q < stride; q++) {
+					const Complex a0 = x[q + stride * p], a1 = x[q + stride * (p + m)];
+					const Complex a2 = x[q + stride * (p + 2 * m)], a3 = x[q + stride * (p + 3 * m)];
+					const Complex t0 = a0 + a2, t1 = a0 - a2, t2 = a1 + a3;
+					const Complex d = a1 - a3;  // Times -i, or +i for the inverse
+					const Complex t3 = Inverse ? Complex(-d.imag(), d.real()) : Complex(d.imag(), -d.real());
+					y[q + stride * (4 * p)] = t0 + t2;
+					y[q + stride * (4 * p + 1)] = mul(t1 + t3, w1);
+					y[q + stride * (4 * p + 2)] = mul(t0 - t2, w2);
+					y[q + stride * (4 * p + 3)] = mul(t1 - t3, w3);
+				}
+			}
+		} else if (radix == 2) {
+			for (int p = 0; p < m; p++) {
+				const Complex w = root[p * stride];
+				for (int q = 0; q < stride; q++) {
+					const Complex a = x[q + stride * p], b = x[q + stride * (p + m)];
+					y[q + stride * (2 * p)] = a + b;
+					y[q + stride * (2 * p + 1)] = mul(a - b, w);
+				}
+			}
+		} else {
+			// Odd prime radix. Outputs u and radix - u share the sums
+			// s_t = a_t + a_(radix-t) and d_t = a_t - a_(radix-t):
+			// X_u = a_0 + sum s_t cos(2pi tu/radix) -/+ i sum d_t sin(2pi tu/radix)
+			const int half = radix / 2;
+			Real cosine[MAX_DIRECT_RADIX], sine[MAX_DIRECT_RADIX];
+			for (int k = 0; k < radix; k++) {
+				cosine[k] = root[k * (n / radix)].real();
+				sine[k] = -root[k * (n / radix)].imag();
+			}
+			Complex s[MAX_DIRECT_RADIX], d[MAX_DIRECT_RADIX];
+			for (int p = 0; p < m; p++) {
+				for (int q = 0; q < stride; q++) {
+					const Complex a0 = x[q + stride * p];
+					Complex dc = a0;
+					for (int t = 1; t <= half; t++) {
+						const Complex a = x[q + stride * (p + t * m)], b = x[q + stride * (p + (radix - t) * m)];
+						s[t] = a + b;
+						d[t] = a - b;
+						dc += s[t];
+					}
+					y[q + stride * (radix * p)] = dc;
+					for (int u = 1; u <= half; u++) {
+						Complex even = a0, odd = Real(0);
+						for (int t = 1, k = u; t <= half; t++, k = k + u < radix ? k + u : k + u - radix) {
+							even += s[t] * cosine[k];
+							odd += d[t] * sine[k];
+						}
+						const Complex iOdd(-odd.imag(), odd.real());
+						y[q + stride * (radix * p + u)] = mul(even - iOdd, root[p * u * stride]);
+						y[q + stride * (radix * p + radix - u)] = mul(even + iOdd, root[p * (radix - u) * stride]);
+					}
+				}
+			}
+		}
+	}
+
+	// X_k = c_k sum_j (x_j c_j) conj(c_(k-j)) with c_j = exp(-i pi j^2 / n),
+	// a convolution done with two power-of-two transforms of length >= 2n - 1
+	void planBluestein() {
+		int length = 1;
+		while (length < 2 * n - 1) length *= 2;
+		convolution = std::make_unique<BasicFftPlan>();
+		convolution->plan(length);
+
+		chirp.resize(n);
+		for (long long j = 0; j < n; j++) chirp[j] = Complex(std::polar(1.0, -M_PI * double(j * j % (2LL * n)) / n));
+		chirpSpectrum.assign(length, Complex(0));
+		chirpSpectrum[0] = std::conj(chirp[0]);
+		for (int j = 1; j < n; j++) chirpSpectrum[j] = chirpSpectrum[length - j] = std::conj(chirp[j]);
+		std::vector<Complex> scratch(length);
+		convolution->forward(chirpSpectrum.data(), scratch.data());
+		for (auto &value : chirpSpectrum) value /= Real(length);  // folds in the inverse transform's 1/length
+	}
+
+	// The inverse transform runs forward on the conjugate
+	void forwardBluestein(Complex *data, Complex *scratch) const {
+		const int length = convolution->n;
+		Complex *a = scratch, *work = scratch + length;
+		for (int j = 0; j < n; j++) a[j] = mul(data[j], chirp[j]);
+		std::fill(a + n, a + length, Complex(0));
+		convolution->forward(a, work);
+		for (int j = 0; j < length; j++) a[j] = std::conj(mul(a[j], chirpSpectrum[j]));
+		convolution->forward(a, work);
+		for (int k = 0; k < n; k++) data[k] = mul(std::conj(a[k]), chirp[k]);
+	}
+
+	int n = 0;
+	std::vector<int> radices;
+	std::vector<Complex> roots, inverseRoots;
+	std::unique_ptr<BasicFftPlan> convolution;
+	std::vector<Complex> chirp, chirpSpectrum;
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Persistent threads that all run the same job, each with its worker index.
+// The calling thread takes part as worker 0
+class WorkerPool {
+public:
+	~WorkerPool() { stop(); }
+
+	void start(int count) {
+		stop();
+		workerCount = std::max(count, 1);
+		size_t seen = generation;
+		for (int w = 1; w < workerCount; ++w) threads.emplace_back([this, w, seen] { loop(w, seen); });
+	}
+
+	int size() const { return workerCount; }
+
+	template <class Job> void run(Job &&job) {
+		if (workerCount == 1) {
+			job(0);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			jobContext = &job;
+			jobInvoke = [](void *context, int w) { (*static_cast<std::remove_reference_t<Job> *>(context))(w); };
+			pending = workerCount - 1;
+			++generation;
+		}
+		wake.notify_all();
+		job(0);
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this] { return pending == 0; });
+	}
+
+private:
+	void loop(int w, size_t seen) {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			wake.wait(lock, [&] { return generation != seen || stopping; });
+			if (stopping) return;
+			seen = generation;
+			lock.unlock();
+			jobInvoke(jobContext, w);
+			lock.lock();
+			if (--pending == 0) done.notify_one();
+		}
+	}
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto &t : threads) t.join();
+		threads.clear();
+		stopping = false;
+	}
+
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	void *jobContext = nullptr;
+	void (*jobInvoke)(void *, int) = nullptr;
+	size_t generation = 0;
+	int pending = 0;
+	int workerCount = 1;
+	bool stopping = false;
+};